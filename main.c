@@ -1,5 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
 #include <nfc/nfc.h>
 #include <getopt.h>
 #include "nfc-utils.h"
@@ -15,6 +18,7 @@ static nfc_target ant[MAX_TARGET_COUNT];
 static uint8_t abtRx[MAX_FRAME_LEN];
 static uint8_t tag_length;
 static st_srx_tag_t dump;
+static st_srx_tag_t patch_mask;
 
 static const nfc_modulation nmISO14443B = {
         .nmt = NMT_ISO14443B,
@@ -29,15 +33,20 @@ static const nfc_modulation nmSTSRx = {
 
 static void
 print_usage(const char *progname) {
-    fprintf(stderr, "usage: %s [-h] [-v] [-w | -d] [-t x4k|512] [-f FILE]\n", progname);
+    fprintf(stderr, "usage: %s [-h] [-v] [-w | -p] [-d] [-t x4k|512] [-f FILE] [BLOCK=VALUE[/MASK] ...]\n",
+            progname);
     fprintf(stderr, "\nOptions:\n");
     fprintf(stderr, "  -h         Show this help message\n");
     fprintf(stderr, "  -v         Verbose - print transceived messages\n");
     fprintf(stderr, "  -w         Write dump instead of reading\n");
+    fprintf(stderr, "  -p         Patch only the given blocks, from the command line or from FILE\n");
     fprintf(stderr, "  -d         Dry run - check for potential irreversible changes instead of writing\n");
     fprintf(stderr, "  -f FILE    Dump (write) memory content to (from) FILE\n");
     fprintf(stderr, "  -f -       Dump (write) memory content to stdout (from stdin) (default)\n");
     fprintf(stderr, "  -t x4k|512 Select SRIX4K or SRI512 tag type. Default is SRIX4K\n");
+    fprintf(stderr, "\nPatch entries (-p) have the form BLOCK=VALUE[/MASK]. BLOCK is decimal or\n");
+    fprintf(stderr, "0x-prefixed hex, VALUE and MASK are 32-bit hex words. Only the bits set in MASK\n");
+    fprintf(stderr, "are changed.\n");
 }
 
 
@@ -106,17 +115,23 @@ dump_eeprom(st_srx_tag_t *dest, bool verbose) {
     return EXIT_SUCCESS;
 }
 
+static uint32_t
+block_to_u32(const uint8_t *block) {
+    return (uint32_t) block[0] << 24 | (uint32_t) block[1] << 16 | (uint32_t) block[2] << 8 | block[3];
+}
+
 static void
-write_dry_run(st_srx_tag_t *file_dump) {
-    st_srx_tag_t tag_dump;
-    fprintf(stderr, "Reading tag...\n");
-    dump_eeprom(&tag_dump, false);
+u32_to_block(uint8_t *block, uint32_t val) {
+    block[0] = val >> 24;
+    block[1] = val >> 16;
+    block[2] = val >> 8;
+    block[3] = val;
+}
 
-    fprintf(stderr, "\nChecking system area\n");
-    uint32_t tag_sys = tag_dump.srix4k.system_block[0] << 24 | tag_dump.srix4k.system_block[1] << 16 |
-                       tag_dump.srix4k.system_block[2] << 8 | tag_dump.srix4k.system_block[3];
-    uint32_t file_sys = file_dump->srix4k.system_block[0] << 24 | file_dump->srix4k.system_block[1] << 16 |
-                        file_dump->srix4k.system_block[2] << 8 | file_dump->srix4k.system_block[3];
+static void
+check_system_block(const uint8_t *tag_block, const uint8_t *file_block) {
+    uint32_t tag_sys = block_to_u32(tag_block);
+    uint32_t file_sys = block_to_u32(file_block);
 
     if ((file_sys & tag_sys) != tag_sys) {
         fprintf(stderr, "Tag system area would irreversibly be updated. In particular:\n");
@@ -142,41 +157,69 @@ write_dry_run(st_srx_tag_t *file_dump) {
             fprintf(stderr, "- Fixed chip ID would be set to %02X\n", file_sys & 0xFF);
         }
     }
+}
 
+// Returns true if updating the block 6 counter would trigger the OTP area auto-erase cycle
+static bool
+counter_autoerase(const uint8_t *tag_block, const uint8_t *file_block) {
+    uint32_t tag_val = block_to_u32(tag_block);
+    uint32_t file_val = block_to_u32(file_block);
+
+    return file_val < tag_val && ((tag_val ^ file_val) >> (32 - 11) > 0);
+}
+
+// Returns true if the update would trigger the OTP area auto-erase cycle
+static bool
+check_counter_block(int i, const uint8_t *tag_block, const uint8_t *file_block) {
+    uint32_t tag_val = block_to_u32(tag_block);
+    uint32_t file_val = block_to_u32(file_block);
     bool autoerase = false;
-    fprintf(stderr, "\nChecking 32-bit binary counters\n");
-    for (int i = 5; i <= 6; i++) {
-        uint32_t tag_val = tag_dump.raw_blocks[i][0] << 24 | tag_dump.raw_blocks[i][1] << 16 |
-                           tag_dump.raw_blocks[i][2] << 8 | tag_dump.raw_blocks[i][3];
-        uint32_t file_val = file_dump->raw_blocks[i][0] << 24 | file_dump->raw_blocks[i][1] << 16 |
-                            file_dump->raw_blocks[i][2] << 8 | file_dump->raw_blocks[i][3];
 
-        if (file_val < tag_val) {
-            fprintf(stderr, "Counter at block %d would be updated", i);
+    if (file_val < tag_val) {
+        fprintf(stderr, "Counter at block %d would be updated", i);
 
-            if (i == 6 && ((tag_val ^ file_val) >> (32 - 11) > 0)) {
-                fprintf(stderr, " (OTP area auto-erase cycle triggered)");
-                autoerase = true;
-            }
+        if (i == 6 && counter_autoerase(tag_block, file_block)) {
+            fprintf(stderr, " (OTP area auto-erase cycle triggered)");
+            autoerase = true;
+        }
 
-            fputc('\n', stderr);
+        fputc('\n', stderr);
+    }
+    return autoerase;
+}
+
+static void
+check_otp_block(int i, const uint8_t *tag, const uint8_t *file, bool autoerase) {
+    for (int j = 0; j < 4; j++) {
+        if (autoerase && tag[j] != file[j]) {
+            fprintf(stderr, "Block %d would be changed (due to auto-erase)\n", i);
+            break;
+        }
+        if ((tag[j] & file[j]) != tag[j]) {
+            fprintf(stderr, "Block %d would be updated\n", i);
+            break;
         }
     }
+}
+
+static void
+write_dry_run(st_srx_tag_t *file_dump) {
+    st_srx_tag_t tag_dump;
+    fprintf(stderr, "Reading tag...\n");
+    dump_eeprom(&tag_dump, false);
+
+    fprintf(stderr, "\nChecking system area\n");
+    check_system_block(tag_dump.srix4k.system_block, file_dump->srix4k.system_block);
+
+    bool autoerase = false;
+    fprintf(stderr, "\nChecking 32-bit binary counters\n");
+    for (int i = 5; i <= 6; i++) {
+        autoerase |= check_counter_block(i, tag_dump.raw_blocks[i], file_dump->raw_blocks[i]);
+    }
 
     fprintf(stderr, "\nChecking resettable OTP area\n");
     for (int i = 0; i <= 4; i++) {
-        uint8_t *tag = tag_dump.raw_blocks[i];
-        uint8_t *file = file_dump->raw_blocks[i];
-        for (int j = 0; j < 4; j++) {
-            if (autoerase && tag[j] != file[j]) {
-                fprintf(stderr, "Block %d would be changed (due to auto-erase)\n", i);
-                break;
-            }
-            if ((tag[j] & file[j]) != tag[j]) {
-                fprintf(stderr, "Block %d would be updated\n", i);
-                break;
-            }
-        }
+        check_otp_block(i, tag_dump.raw_blocks[i], file_dump->raw_blocks[i], autoerase);
     }
 }
 
@@ -233,6 +276,217 @@ write_eeprom(st_srx_tag_t *src, bool verbose) {
 }
 
 
+static bool
+block_in_tag(unsigned long block) {
+    return block < tag_length || block == 0xFF;
+}
+
+static int
+parse_patch_entry(const char *entry, st_srx_tag_t *values, st_srx_tag_t *masks) {
+    char *end;
+    unsigned long block, value, mask = 0xFFFFFFFF;
+
+    // strtoul() accepts leading whitespace and signs, only allow plain numbers.
+    // Leading zeros don't mean octal, only a 0x prefix selects hex.
+    int base = (entry[0] == '0' && (entry[1] == 'x' || entry[1] == 'X')) ? 16 : 10;
+    errno = 0;
+    block = strtoul(entry, &end, base);
+    if (!isdigit((unsigned char) *entry) || end == entry || *end != '=' || errno != 0 ||
+        !block_in_tag(block)) {
+        fprintf(stderr, "Invalid block in patch entry '%s'\n", entry);
+        return EXIT_FAILURE;
+    }
+
+    const char *value_str = end + 1;
+    value = strtoul(value_str, &end, 16);
+    if (!isxdigit((unsigned char) *value_str) || end == value_str || (*end != '\0' && *end != '/') ||
+        errno != 0 || value > 0xFFFFFFFF) {
+        fprintf(stderr, "Invalid value in patch entry '%s'\n", entry);
+        return EXIT_FAILURE;
+    }
+
+    if (*end == '/') {
+        const char *mask_str = end + 1;
+        mask = strtoul(mask_str, &end, 16);
+        if (!isxdigit((unsigned char) *mask_str) || end == mask_str || *end != '\0' || errno != 0 ||
+            mask == 0 || mask > 0xFFFFFFFF) {
+            fprintf(stderr, "Invalid mask in patch entry '%s'\n", entry);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Later entries for the same block are merged on top of earlier ones
+    uint32_t old_value = block_to_u32(values->raw_blocks[block]);
+    uint32_t old_mask = block_to_u32(masks->raw_blocks[block]);
+    u32_to_block(values->raw_blocks[block], (old_value & ~mask) | (value & mask));
+    u32_to_block(masks->raw_blocks[block], old_mask | mask);
+
+    return EXIT_SUCCESS;
+}
+
+static int
+read_patch_file(st_srx_tag_t *values, st_srx_tag_t *masks, FILE *patch_fd) {
+    char line[256];
+    while (fgets(line, sizeof(line), patch_fd) != NULL) {
+        // A chunk without newline is only fine for the last line, otherwise
+        // comments and entries would be split across chunks
+        if (strchr(line, '\n') == NULL) {
+            int next = fgetc(patch_fd);
+            if (next != EOF) {
+                fprintf(stderr, "Patch file line too long\n");
+                return EXIT_FAILURE;
+            }
+        }
+
+        // Strip comments
+        char *comment = strchr(line, '#');
+        if (comment != NULL)
+            *comment = '\0';
+
+        for (char *entry = strtok(line, " \t\r\n"); entry != NULL; entry = strtok(NULL, " \t\r\n")) {
+            if (parse_patch_entry(entry, values, masks) != EXIT_SUCCESS)
+                return EXIT_FAILURE;
+        }
+    }
+    if (ferror(patch_fd)) {
+        perror("Error reading patch file");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+static bool
+patch_is_empty(st_srx_tag_t *masks) {
+    for (int i = 0; i < DUMP_LEN; i++) {
+        if (block_to_u32(masks->raw_blocks[i]) != 0)
+            return false;
+    }
+    return true;
+}
+
+static int
+patch_eeprom(st_srx_tag_t *values, st_srx_tag_t *masks, bool dry_run, bool verbose) {
+    static const uint8_t erased_block[4] = {0xFF, 0xFF, 0xFF, 0xFF};
+    st_srx_tag_t tag_dump;
+    st_srx_tag_t new_dump;
+    bool touched[DUMP_LEN] = {false};
+    bool autoerase = false;
+
+    // Read only the blocks being patched
+    fprintf(stderr, "Reading patched blocks\n");
+    for (int i = 0; i < DUMP_LEN; i++) {
+        if (block_to_u32(masks->raw_blocks[i]) == 0)
+            continue;
+
+        if (st_srx_read_block(pnd, tag_dump.raw_blocks[i], i, verbose) <= 0) {
+            nfc_perror(pnd, "nfc_initiator_transceive_bytes");
+            nfc_close(pnd);
+            nfc_exit(context);
+            return EXIT_FAILURE;
+        }
+        touched[i] = true;
+    }
+
+    // A block 6 update may auto-erase the OTP blocks, which then changes them
+    // even when they are not part of the patch. Unpatched OTP blocks are only
+    // read to report them in the dry run, the write doesn't need them.
+    if (touched[6]) {
+        uint32_t mask = block_to_u32(masks->raw_blocks[6]);
+        uint32_t tag_val = block_to_u32(tag_dump.raw_blocks[6]);
+        uint32_t patch_val = block_to_u32(values->raw_blocks[6]);
+        u32_to_block(new_dump.raw_blocks[6], (tag_val & ~mask) | (patch_val & mask));
+        autoerase = counter_autoerase(tag_dump.raw_blocks[6], new_dump.raw_blocks[6]);
+    }
+    if (autoerase && dry_run) {
+        for (int i = 0; i <= 4; i++) {
+            if (touched[i])
+                continue;
+
+            if (st_srx_read_block(pnd, tag_dump.raw_blocks[i], i, verbose) <= 0) {
+                nfc_perror(pnd, "nfc_initiator_transceive_bytes");
+                nfc_close(pnd);
+                nfc_exit(context);
+                return EXIT_FAILURE;
+            }
+            touched[i] = true;
+        }
+    }
+
+    // Patch on top of the content the tag will have when the block is written
+    for (int i = 0; i < DUMP_LEN; i++) {
+        if (!touched[i])
+            continue;
+
+        const uint8_t *current = (autoerase && i <= 4) ? erased_block : tag_dump.raw_blocks[i];
+        uint32_t mask = block_to_u32(masks->raw_blocks[i]);
+        uint32_t patch_val = block_to_u32(values->raw_blocks[i]);
+        u32_to_block(new_dump.raw_blocks[i], (block_to_u32(current) & ~mask) | (patch_val & mask));
+    }
+
+    if (dry_run) {
+        fprintf(stderr, "\nPatched blocks\n");
+        for (int i = 0; i < DUMP_LEN; i++) {
+            if (touched[i]) {
+                fprintf(stderr, "Block %d: %08X -> %08X\n", i, block_to_u32(tag_dump.raw_blocks[i]),
+                        block_to_u32(new_dump.raw_blocks[i]));
+            }
+        }
+
+        fprintf(stderr, "\nChecking system area\n");
+        if (touched[0xFF])
+            check_system_block(tag_dump.raw_blocks[0xFF], new_dump.raw_blocks[0xFF]);
+
+        fprintf(stderr, "\nChecking 32-bit binary counters\n");
+        for (int i = 5; i <= 6; i++) {
+            if (touched[i])
+                check_counter_block(i, tag_dump.raw_blocks[i], new_dump.raw_blocks[i]);
+        }
+
+        fprintf(stderr, "\nChecking resettable OTP area\n");
+        for (int i = 0; i <= 4; i++) {
+            if (touched[i])
+                check_otp_block(i, tag_dump.raw_blocks[i], new_dump.raw_blocks[i], autoerase);
+        }
+        return EXIT_SUCCESS;
+    }
+
+    // Write the counters first, so an auto-erase triggered by block 6 can't
+    // wipe patched OTP blocks, then the OTP blocks and the rest of the tag.
+    // The system block (0xFF) comes last.
+    int order[DUMP_LEN];
+    int order_len = 0;
+    order[order_len++] = 5;
+    order[order_len++] = 6;
+    for (int i = 0; i <= 4; i++)
+        order[order_len++] = i;
+    for (int i = 7; i < DUMP_LEN; i++)
+        order[order_len++] = i;
+
+    fprintf(stderr, "Writing patched blocks\n|");
+    for (int n = 0; n < order_len; n++) {
+        int i = order[n];
+        if (block_to_u32(masks->raw_blocks[i]) == 0)
+            continue;
+
+        const uint8_t *current = (autoerase && i <= 4) ? erased_block : tag_dump.raw_blocks[i];
+        if (memcmp(new_dump.raw_blocks[i], current, 4) != 0) {
+            if (st_srx_write_block(pnd, abtRx, i, new_dump.raw_blocks[i], verbose) <= 0) {
+                nfc_perror(pnd, "nfc_initiator_transceive_bytes");
+                nfc_close(pnd);
+                nfc_exit(context);
+                return EXIT_FAILURE;
+            }
+            if (!verbose)
+                fputc('.', stderr);
+        } else if (!verbose) {
+            fputc(' ', stderr);
+        }
+    }
+    fprintf(stderr, "|\n");
+
+    return EXIT_SUCCESS;
+}
+
 int
 main(int argc, const char *argv[]) {
 
@@ -242,11 +496,12 @@ main(int argc, const char *argv[]) {
     bool verbose = false;
     bool write = false;
     bool dry_run = false;
+    bool patch = false;
 
     FILE *dump_fd;
 
     // Parse arguments
-    while ((ch = getopt(argc, (char *const *) argv, "hvwdt:f:")) != -1) {
+    while ((ch = getopt(argc, (char *const *) argv, "hvwpdt:f:")) != -1) {
         switch (ch) {
             case 'h':
                 print_usage(argv[0]);
@@ -260,6 +515,9 @@ main(int argc, const char *argv[]) {
             case 'w':
                 write = true;
                 break;
+            case 'p':
+                patch = true;
+                break;
             case 'd':
                 dry_run = true;
                 break;
@@ -272,6 +530,11 @@ main(int argc, const char *argv[]) {
         }
     }
 
+    if ((optind < argc && !patch) || (patch && write)) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
     if (tag_type == NULL || strcmp(tag_type, "x4k") == 0) {
         tag_length = SRIX4K_EEPROM_LEN;
     } else if (strcmp(tag_type, "512") == 0) {
@@ -282,8 +545,11 @@ main(int argc, const char *argv[]) {
     }
 
     // Open output file
-    if (dump_file == NULL || (strlen(dump_file) == 1 && dump_file[0] == '-')) {
-        if (!write) {
+    if (patch && dump_file == NULL && optind < argc) {
+        // Patch entries only given on the command line, no file needed
+        dump_fd = NULL;
+    } else if (dump_file == NULL || (strlen(dump_file) == 1 && dump_file[0] == '-')) {
+        if (!write && !patch) {
             printf("stdout %s\n", dump_file);
             dump_fd = stdout;
         } else {
@@ -291,7 +557,7 @@ main(int argc, const char *argv[]) {
             dump_fd = stdin;
         }
     } else {
-        if (!write && !dry_run) {
+        if (!write && !dry_run && !patch) {
             printf("wb %s\n", dump_file);
             dump_fd = fopen(dump_file, "wb");
         } else {
@@ -304,9 +570,27 @@ main(int argc, const char *argv[]) {
         }
     }
 
-    if (dump_fd == NULL) {
-        perror("Error opening dump file");
-        exit(EXIT_FAILURE);
+    if (patch) {
+        // Parse the patch before waiting for a tag, then close the file
+        int ret = EXIT_SUCCESS;
+        if (dump_fd != NULL) {
+            ret = read_patch_file(&dump, &patch_mask, dump_fd);
+            if (dump_fd != stdin)
+                fclose(dump_fd);
+            dump_fd = NULL;
+        }
+
+        // Command line entries are applied on top of the patch file
+        for (int i = optind; ret == EXIT_SUCCESS && i < argc; i++) {
+            ret = parse_patch_entry(argv[i], &dump, &patch_mask);
+        }
+
+        if (ret == EXIT_SUCCESS && patch_is_empty(&patch_mask)) {
+            fprintf(stderr, "Patch has no entries\n");
+            ret = EXIT_FAILURE;
+        }
+        if (ret != EXIT_SUCCESS)
+            exit(EXIT_FAILURE);
     }
 
     if (dry_run) {
@@ -317,7 +601,8 @@ main(int argc, const char *argv[]) {
     nfc_init(&context);
     if (context == NULL) {
         ERR("Unable to init libnfc (malloc)");
-        fclose(dump_fd);
+        if (dump_fd != NULL)
+            fclose(dump_fd);
         exit(EXIT_FAILURE);
     }
 
@@ -328,13 +613,15 @@ main(int argc, const char *argv[]) {
     pnd = nfc_open(context, NULL);
     if (pnd == NULL) {
         ERR("Error opening NFC reader");
-        fclose(dump_fd);
+        if (dump_fd != NULL)
+            fclose(dump_fd);
         nfc_exit(context);
         exit(EXIT_FAILURE);
     }
 
     if (nfc_initiator_init(pnd) < 0) {
-        fclose(dump_fd);
+        if (dump_fd != NULL)
+            fclose(dump_fd);
         nfc_perror(pnd, "nfc_initiator_init");
         nfc_close(pnd);
         nfc_exit(context);
@@ -351,7 +638,8 @@ main(int argc, const char *argv[]) {
 
     // Infinite select for tag
     if (nfc_initiator_select_passive_target(pnd, nmSTSRx, NULL, 0, nt) <= 0) {
-        fclose(dump_fd);
+        if (dump_fd != NULL)
+            fclose(dump_fd);
         nfc_perror(pnd, "nfc_initiator_select_passive_target");
         nfc_close(pnd);
         nfc_exit(context);
@@ -364,7 +652,8 @@ main(int argc, const char *argv[]) {
     fprintf(stderr, "Found ISO14443B-2 tag, UID:\n");
     size_t received_bytes = st_srx_get_uid(pnd, abtRx, true);
     if (received_bytes <= 0) {
-        fclose(dump_fd);
+        if (dump_fd != NULL)
+            fclose(dump_fd);
         ERR("Failed to retrieve the UID");
         nfc_perror(pnd, "nfc_initiator_transceive_bytes");
         nfc_close(pnd);
@@ -373,7 +662,9 @@ main(int argc, const char *argv[]) {
     }
 
     int ret = EXIT_SUCCESS;
-    if (dry_run) {
+    if (patch) {
+        ret = patch_eeprom(&dump, &patch_mask, dry_run, verbose);
+    } else if (dry_run) {
         ret = read_dump_file(&dump, dump_fd);
         if (ret == EXIT_SUCCESS) {
             write_dry_run(&dump);
@@ -395,7 +686,8 @@ main(int argc, const char *argv[]) {
         exit(ret);
     }
 
-    fclose(dump_fd);
+    if (dump_fd != NULL)
+        fclose(dump_fd);
 
     nfc_close(pnd);
     nfc_exit(context);